@@ -0,0 +1,100 @@
+#!/bin/bash
+# Runs the 5-fold cross-validation of the plate detector: for each fold
+# X, training on foldX/trainX.txt followed by testing on foldX/testX.txt
+# with the parameters learned in foldX/output-parameters.txt.
+#
+# The folds are independent, so up to <njobs> of them run at the same
+# time, and the OpenMP threads are split among them (set OMP_NUM_THREADS
+# to override). Each job runs inside foldX/train and foldX/test, so the
+# result_* images of concurrent jobs do not overwrite each other. The
+# logs and the time of each job are kept in foldX. The exit status is 1
+# when any fold fails.
+#
+# usage: ./crossvalidation.sh [<kernel-bank.txt>] [<njobs>] [<folds>]
+# e.g.:  ./crossvalidation.sh rand-kernel-bank.txt 2 "1 3"
+#
+# A kernel bank given on the command line is relative to the current
+# directory; the default one is the kernel-bank.txt next to this script.
+
+[ -n "$1" ] && KBANK=$(realpath -m -- "$1")
+
+cd "$(dirname "$0")" || exit 1
+
+KBANK=${KBANK:-$(realpath kernel-bank.txt)}
+NJOBS=${2:-$(nproc)}
+FOLDS=${3:-"1 2 3 4 5"}
+BIN=$(realpath bin)
+
+case "$NJOBS" in
+    ''|*[!0-9]*|0*) echo "the number of jobs must be an integer >= 1, not '$NJOBS'"; exit 1 ;;
+esac
+
+if [ ! -f "$KBANK" ] || [ ! -x "$BIN/training" ] || [ ! -x "$BIN/testing" ]; then
+    echo "requires $KBANK, $BIN/training and $BIN/testing (make training testing)"
+    exit 1
+fi
+
+if [ -z "$OMP_NUM_THREADS" ]; then
+    export OMP_NUM_THREADS=$(( $(nproc) / NJOBS > 0 ? $(nproc) / NJOBS : 1 ))
+fi
+
+now() { date +%s.%N; }
+elapsed() { awk -v s="$1" -v e="$2" 'BEGIN { printf "%.2f", e-s }'; }
+
+# run_phase <fold> <train|test> <program> <list>
+run_phase() {
+    local dir=fold$1/$2 start status
+    ln -sfn ../../imagens "$dir/imagens"
+    start=$(now)
+    (cd "$dir" && "$BIN/$3" "../$4" "$KBANK" ../output-parameters.txt > "../$3.log" 2>&1)
+    status=$?
+    echo "fold $1 $3 $(elapsed "$start" "$(now)")s" >> "fold$1/timings.txt"
+    rm -f "$dir/imagens"
+    return $status
+}
+
+run_fold() {
+    rm -f "fold$1/timings.txt"
+    if ! run_phase "$1" train training "train$1.txt"; then
+        echo "fold $1: training failed, see fold$1/training.log"
+        return 1
+    fi
+    if ! run_phase "$1" test testing "test$1.txt"; then
+        echo "fold $1: testing failed, see fold$1/testing.log"
+        return 1
+    fi
+}
+
+# Keep the pid of each fold to wait for it and collect its exit status
+start=$(now)
+declare -A PID
+for X in $FOLDS; do
+    while [ "$(jobs -rp | wc -l)" -ge "$NJOBS" ]; do
+        wait -n
+    done
+    echo "fold $X started"
+    run_fold "$X" &
+    PID[$X]=$!
+done
+
+FAILED=""
+for X in $FOLDS; do
+    wait "${PID[$X]}" || FAILED="$FAILED $X"
+done
+
+echo
+for X in $FOLDS; do
+    cat "fold$X/timings.txt" 2>/dev/null
+    grep "Average error" "fold$X/testing.log" 2>/dev/null | sed "s/^/fold $X /"
+done
+
+for X in $FOLDS; do
+    grep "Average error" "fold$X/testing.log" 2>/dev/null
+done | awk '{ sum += $NF; n++ }
+     END { if (n > 0) printf "Mean average error over %d folds: %.2f\n", n, sum/n }'
+echo "Total time: $(elapsed "$start" "$(now)")s with $NJOBS jobs of $OMP_NUM_THREADS threads"
+
+if [ -n "$FAILED" ]; then
+    echo "Failed folds:$FAILED"
+    exit 1
+fi
@@ -1,5 +1,9 @@
 #include "include/ift.h"
 #include <math.h>
+#include <sys/mman.h>
+
+#define BUFFER_ALIGNMENT  64        /* cache line */
+#define HUGE_PAGE_SIZE    (1L<<21)  /* 2 MB transparent huge pages */
 
 typedef struct mkernel { /* multiband kernel */
   iftAdjRel *A;          /* adjacency relation */
@@ -13,6 +17,26 @@ typedef struct mkernelbank { /* kernel bank */
   int       nkernels;  /* number of kernels */
 } MKernelBank;
 
+typedef struct qmkernel { /* multiband kernel quantized to 8 bits */
+  iftAdjRel   *A;        /* adjacency relation */
+  signed char *weight;   /* weights interleaved by band: weight[i*nbands+b] */
+  float        scale;    /* real weight = scale * quantized weight */
+  float        bias;     /* bias (kept in float) */
+  int          nbands;   /* number of bands */
+} QMKernel;
+
+typedef struct qmkernelbank { /* quantized kernel bank */
+  QMKernel **K;         /* a vector of quantized multiband kernels */
+  int        nkernels;  /* number of kernels */
+} QMKernelBank;
+
+typedef struct qmimage { /* multi-band image quantized to 8 bits */
+  uchar *val;               /* values band by band: val[b*n+p] */
+  float  scale;             /* real value = scale * quantized value */
+  int    xsize,ysize,zsize; /* image dimensions */
+  int    n,m;               /* number of voxels and number of bands */
+} QMImage;
+
 typedef struct net_parameters { /* parameters of the system */
   float *weight;    /* weight of each band (kernel) */
   int    nkernels;  /* number of kernels */
@@ -170,6 +194,119 @@ void DestroyMKernelBank(MKernelBank **Kbank)
   *Kbank = NULL;
 }
 
+/* Allocate a buffer of n bytes aligned to the cache line, so that no
+   cache line is shared with other data. Buffers of at least one huge
+   page are aligned to it and marked for transparent huge pages, to
+   reduce TLB misses on large volumes. The buffer is not initialized:
+   its pages are only faulted in when the caller first writes them
+   (after the huge page advice), so callers that need zeros must clear
+   it themselves. Release it with iftFree. */
+
+uchar *AllocAlignedBuffer(long n)
+{
+  void  *buf = NULL;
+  size_t alignment = (n >= HUGE_PAGE_SIZE)? HUGE_PAGE_SIZE : BUFFER_ALIGNMENT;
+
+  if (posix_memalign(&buf, alignment, (n > 0)? n : 1) != 0)
+    iftError("Cannot allocate %ld bytes","AllocAlignedBuffer",n);
+
+#ifdef MADV_HUGEPAGE
+  if (n >= HUGE_PAGE_SIZE)
+    madvise(buf, n, MADV_HUGEPAGE);
+#endif
+
+  return((uchar *)buf);
+}
+
+/* Quantize the weights of a kernel bank to 8 bits. Each kernel has
+   its own scale factor, given by its largest absolute weight. */
+
+QMKernelBank *QuantizeMKernelBank(MKernelBank *Kbank)
+{
+  QMKernelBank *Qbank = (QMKernelBank *)calloc(1,sizeof(QMKernelBank));
+
+  Qbank->K        = (QMKernel **)calloc(Kbank->nkernels,sizeof(QMKernel *));
+  Qbank->nkernels = Kbank->nkernels;
+
+  for (int k=0; k < Kbank->nkernels; k++){
+    MKernel  *K    = Kbank->K[k];
+    QMKernel *QK   = (QMKernel *)iftAlloc(1,sizeof(QMKernel));
+    float     maxw = 0.0;
+
+    QK->A      = iftCopyAdjacency(K->A);
+    QK->nbands = K->nbands;
+    QK->bias   = K->bias;
+    QK->weight = (signed char *)AllocAlignedBuffer(K->A->n*K->nbands);
+
+    for (int i=0; i < K->A->n; i++)
+      for (int b=0; b < K->nbands; b++)
+	if (fabs(K->weight[b].val[i]) > maxw)
+	  maxw = fabs(K->weight[b].val[i]);
+
+    QK->scale = (maxw > 0.0)? maxw/127.0 : 1.0;
+
+    for (int i=0; i < K->A->n; i++)
+      for (int b=0; b < K->nbands; b++)
+	QK->weight[i*K->nbands+b] = (signed char)iftRound(K->weight[b].val[i]/QK->scale);
+
+    Qbank->K[k] = QK;
+  }
+
+  return(Qbank);
+}
+
+void DestroyQMKernelBank(QMKernelBank **Qbank)
+{
+  QMKernelBank *aux = *Qbank;
+  for (int k=0; k < aux->nkernels; k++){
+    iftFree(aux->K[k]->weight);
+    iftDestroyAdjRel(&aux->K[k]->A);
+    iftFree(aux->K[k]);
+  }
+  free(aux->K);
+  free(aux);
+  *Qbank = NULL;
+}
+
+/* Quantize a multi-band image with non-negative values (as produced
+   by iftImageToMImage) to 8 bits, using its maximum value as the
+   calibration range. For 8-bit input images it is lossless. */
+
+QMImage *QuantizeMImage(iftMImage *mimg)
+{
+  QMImage *qimg = (QMImage *)iftAlloc(1,sizeof(QMImage));
+  float    maxval = 0.0;
+
+  qimg->xsize = mimg->xsize;
+  qimg->ysize = mimg->ysize;
+  qimg->zsize = mimg->zsize;
+  qimg->n     = mimg->n;
+  qimg->m     = mimg->m;
+  qimg->val   = AllocAlignedBuffer((long)mimg->n*mimg->m);
+
+  for (int b=0; b < mimg->m; b++)
+    maxval = iftMax(maxval,iftMMaximumValue(mimg,b));
+  qimg->scale = (maxval > 255.0)? maxval/255.0 : 1.0;
+
+  for (int b=0; b < mimg->m; b++)
+    for (int p=0; p < mimg->n; p++){
+      float val = mimg->band[b].val[p]/qimg->scale;
+      qimg->val[(long)b*mimg->n+p] = (uchar)iftRound(iftMax(0.0,iftMin(255.0,val)));
+    }
+
+  return(qimg);
+}
+
+void DestroyQMImage(QMImage **qimg)
+{
+  QMImage *aux = *qimg;
+  if (aux != NULL){
+    iftFree(aux->val);
+    iftFree(aux);
+    *qimg = NULL;
+  }
+}
+
 /* Activation function known as Rectified Linear Unit (ReLu) */
 
 iftMImage  *ReLu(iftMImage *mult_img)
@@ -185,6 +322,19 @@ iftMImage  *ReLu(iftMImage *mult_img)
   return(activ_img);
 }
 
+/* Same as ReLu, but it overwrites the input image */
+
+void ReLuInPlace(iftMImage *mult_img)
+{
+  for (int b=0; b < mult_img->m; b++) {
+    float *val = mult_img->band[b].val;
+    #pragma omp parallel for
+    for (int p=0; p < mult_img->n; p++)
+      if (!(val[p] > 0))
+	val[p] = 0;
+  }
+}
+
 /* This function is used to emphasize isolated (important)
    activations */
 
@@ -217,48 +367,156 @@ iftMImage  *DivisiveNormalization(iftMImage *mult_img, iftAdjRel *A)
 
 /* Aggregate activations within a neighborhood (stride s = 1) */
 
-iftMImage  *MaxPooling(iftMImage *mult_img, iftAdjRel *A)
+/* Verify if A is a box adjacency (e.g., iftRectangular or iftCuboid),
+   i.e., it contains all displacements within its bounding box, and
+   return the extents of that box along each axis */
+
+bool IsBoxAdjacency(iftAdjRel *A, iftVoxel *dmin, iftVoxel *dmax)
 {
-  iftMImage *pool_img = iftCreateMImage(mult_img->xsize,mult_img->ysize,mult_img->zsize,mult_img->m);
+  dmin->x = dmin->y = dmin->z = IFT_INFINITY_INT;
+  dmax->x = dmax->y = dmax->z = IFT_INFINITY_INT_NEG;
+
+  for (int i=0; i < A->n; i++) {
+    dmin->x = iftMin(dmin->x,A->dx[i]); dmax->x = iftMax(dmax->x,A->dx[i]);
+    dmin->y = iftMin(dmin->y,A->dy[i]); dmax->y = iftMax(dmax->y,A->dy[i]);
+    dmin->z = iftMin(dmin->z,A->dz[i]); dmax->z = iftMax(dmax->z,A->dz[i]);
+  }
 
+  return(A->n == (dmax->x-dmin->x+1)*(dmax->y-dmin->y+1)*(dmax->z-dmin->z+1));
+}
+
+/* Max (or min) of the values in the window [i+lo,i+hi] of a line with
+   n values, clipped to the line, for each position i. The results
+   are written in out with the given stride. */
+
+void SlidingWindowLine(float *line, int n, int lo, int hi, bool max, float *out, int stride)
+{
+  for (int i=0; i < n; i++) {
+    int first = iftMax(0,i+lo), last = iftMin(n-1,i+hi);
+    if (max) {
+      float val = IFT_INFINITY_FLT_NEG;
+      for (int j=first; j <= last; j++)
+	if (line[j] > val)
+	  val = line[j];
+      out[i*stride] = val;
+    } else {
+      float val = IFT_INFINITY_FLT;
+      for (int j=first; j <= last; j++)
+	if (line[j] < val)
+	  val = line[j];
+      out[i*stride] = val;
+    }
+  }
+}
+
+/* Max- or min-pooling with a box adjacency, computed as a sequence of
+   1D sliding windows along x, y, and z. It costs the sum of the box
+   sides per voxel, instead of their product, and gives the same
+   result since the box is clipped to the image domain axis by
+   axis. The input and output bands must be different. */
+
+void SeparablePoolingOnBand(iftMImage *mult_img, int b, iftVoxel dmin, iftVoxel dmax,
+			    bool max, iftMImage *pool_img, int bout)
+{
+  int    xsize = mult_img->xsize, ysize = mult_img->ysize, zsize = mult_img->zsize;
+  float *in    = mult_img->band[b].val, *out = pool_img->band[bout].val;
+
+  #pragma omp parallel for
+  for (int r=0; r < ysize*zsize; r++) /* rows, from input to output */
+    SlidingWindowLine(&in[r*xsize], xsize, dmin.x, dmax.x, max, &out[r*xsize], 1);
+
+  if ((dmin.y != 0)||(dmax.y != 0)) {
+    #pragma omp parallel for
+    for (int c=0; c < xsize*zsize; c++) { /* columns, in place */
+      float *col = &out[(c/xsize)*xsize*ysize + c%xsize];
+      float  line[ysize];
+      for (int y=0; y < ysize; y++)
+	line[y] = col[y*xsize];
+      SlidingWindowLine(line, ysize, dmin.y, dmax.y, max, col, xsize);
+    }
+  }
+
+  if ((dmin.z != 0)||(dmax.z != 0)) {
+    #pragma omp parallel for
+    for (int c=0; c < xsize*ysize; c++) { /* lines along z, in place */
+      float *col = &out[c];
+      float  line[zsize];
+      for (int z=0; z < zsize; z++)
+	line[z] = col[z*xsize*ysize];
+      SlidingWindowLine(line, zsize, dmin.z, dmax.z, max, col, xsize*ysize);
+    }
+  }
+}
+
+/* Max-pooling of band b of mult_img into band bout of a preallocated
+   pool_img with the same domain */
+
+void MaxPoolingOnBand(iftMImage *mult_img, int b, iftAdjRel *A, iftMImage *pool_img, int bout)
+{
+  iftVoxel dmin, dmax;
+
+  if (IsBoxAdjacency(A, &dmin, &dmax)) {
+    SeparablePoolingOnBand(mult_img, b, dmin, dmax, true, pool_img, bout);
+    return;
+  }
+
+  #pragma omp parallel for
   for (int p=0; p < mult_img->n; p++){
     iftVoxel u = iftMGetVoxelCoord(mult_img,p);
-    for (int b=0; b < mult_img->m; b++) {
-      float max  = IFT_INFINITY_FLT_NEG;
-      for (int i=0; i < A->n; i++) {
-	iftVoxel v = iftGetAdjacentVoxel(A,u,i);
-	if (iftMValidVoxel(mult_img,v)){
-	  int q = iftMGetVoxelIndex(mult_img,v);
-	  if (mult_img->band[b].val[q] > max)
-	    max = mult_img->band[b].val[q];
-	}
+    float max  = IFT_INFINITY_FLT_NEG;
+    for (int i=0; i < A->n; i++) {
+      iftVoxel v = iftGetAdjacentVoxel(A,u,i);
+      if (iftMValidVoxel(mult_img,v)){
+	int q = iftMGetVoxelIndex(mult_img,v);
+	if (mult_img->band[b].val[q] > max)
+	  max = mult_img->band[b].val[q];
       }
-      pool_img->band[b].val[p] = max;
     }
+    pool_img->band[bout].val[p] = max;
   }
-
-  return(pool_img);
 }
 
-iftMImage  *MinPooling(iftMImage *mult_img, iftAdjRel *A)
+void MinPoolingOnBand(iftMImage *mult_img, int b, iftAdjRel *A, iftMImage *pool_img, int bout)
 {
-  iftMImage *pool_img = iftCreateMImage(mult_img->xsize,mult_img->ysize,mult_img->zsize,mult_img->m);
+  iftVoxel dmin, dmax;
 
+  if (IsBoxAdjacency(A, &dmin, &dmax)) {
+    SeparablePoolingOnBand(mult_img, b, dmin, dmax, false, pool_img, bout);
+    return;
+  }
+
+  #pragma omp parallel for
   for (int p=0; p < mult_img->n; p++){
     iftVoxel u = iftMGetVoxelCoord(mult_img,p);
-    for (int b=0; b < mult_img->m; b++) {
-      float min  = IFT_INFINITY_FLT;
-      for (int i=0; i < A->n; i++) {
-	iftVoxel v = iftGetAdjacentVoxel(A,u,i);
-	if (iftMValidVoxel(mult_img,v)){
-	  int q = iftMGetVoxelIndex(mult_img,v);
-	  if (mult_img->band[b].val[q] < min)
-	    min = mult_img->band[b].val[q];
-	}
+    float min  = IFT_INFINITY_FLT;
+    for (int i=0; i < A->n; i++) {
+      iftVoxel v = iftGetAdjacentVoxel(A,u,i);
+      if (iftMValidVoxel(mult_img,v)){
+	int q = iftMGetVoxelIndex(mult_img,v);
+	if (mult_img->band[b].val[q] < min)
+	  min = mult_img->band[b].val[q];
       }
-      pool_img->band[b].val[p] = min;
     }
+    pool_img->band[bout].val[p] = min;
   }
+}
+
+iftMImage  *MaxPooling(iftMImage *mult_img, iftAdjRel *A)
+{
+  iftMImage *pool_img = iftCreateMImage(mult_img->xsize,mult_img->ysize,mult_img->zsize,mult_img->m);
+
+  for (int b=0; b < mult_img->m; b++)
+    MaxPoolingOnBand(mult_img, b, A, pool_img, b);
+
+  return(pool_img);
+}
+
+iftMImage  *MinPooling(iftMImage *mult_img, iftAdjRel *A)
+{
+  iftMImage *pool_img = iftCreateMImage(mult_img->xsize,mult_img->ysize,mult_img->zsize,mult_img->m);
+
+  for (int b=0; b < mult_img->m; b++)
+    MinPoolingOnBand(mult_img, b, A, pool_img, b);
 
   return(pool_img);
 }
@@ -290,35 +548,192 @@ iftMImage  *MinPooling(iftMImage *mult_img, iftAdjRel *A)
 //   return filt_img;
 // }
 
-iftMImage *Convolution(iftMImage *mult_img, MKernel *K)
-{
-  iftMImage *filt_img=iftCreateMImage(mult_img->xsize,mult_img->ysize,mult_img->zsize,1); // multi-band image with one band
+/* Convolution of mult_img with K into band bout of a preallocated
+   filt_img with the same domain */
 
+void ConvolutionOnBand(iftMImage *mult_img, MKernel *K, iftMImage *filt_img, int bout)
+{
+  #pragma omp parallel for
   for (int p=0; p < mult_img->n; p++) { // convolution
-    filt_img->band[0].val[p]=0;
+    filt_img->band[bout].val[p]=0;
     iftVoxel u = iftMGetVoxelCoord(mult_img,p);
     for (int i=0; i < K->A->n; i++) { // for each adjacent voxel
       iftVoxel v = iftGetAdjacentVoxel(K->A,u,i);
       if (iftMValidVoxel(mult_img,v)){ // inside the image domain
 	int q = iftMGetVoxelIndex(mult_img,v);
 	for (int b=0; b < K->nbands; b++) { // for each band
-	  filt_img->band[0].val[p] +=
+	  filt_img->band[bout].val[p] +=
 	    K->weight[b].val[i]*mult_img->band[b].val[q];
 	}
       }
     }
-    filt_img->band[0].val[p] += K->bias;
+    filt_img->band[bout].val[p] += K->bias;
   }
+}
+
+iftMImage *Convolution(iftMImage *mult_img, MKernel *K)
+{
+  iftMImage *filt_img=iftCreateMImage(mult_img->xsize,mult_img->ysize,mult_img->zsize,1); // multi-band image with one band
+
+  ConvolutionOnBand(mult_img, K, filt_img, 0);
 
   return(filt_img);
 }
 
+/* Convolution with a quantized kernel: 8-bit products are accumulated
+   in 32-bit integers and only the final sum is scaled back to
+   float. Pixels whose adjacent pixels are all inside the image are
+   processed a row at a time: for each adjacent pixel and band, the
+   band row shifted by that displacement is multiplied by one weight
+   and added to a row of accumulators, a contiguous loop that the
+   compiler vectorizes. The remaining (border) pixels are computed one
+   by one. Integer sums do not depend on the order of the terms, so
+   both cases give the same result. */
+
+void QuantizedConvolutionOnBand(QMImage *qimg, QMKernel *K, iftMImage *filt_img, int bout)
+{
+  iftAdjRel *A     = K->A;
+  float      scale = K->scale*qimg->scale;
+  int        xsize = qimg->xsize, ysize = qimg->ysize;
+  int        nrows = qimg->ysize*qimg->zsize;
+  iftVoxel   dmin  = {0,0,0}, dmax = {0,0,0};
+  long       offset[A->n];
+
+  for (int i=0; i < A->n; i++){
+    dmin.x = iftMin(dmin.x,A->dx[i]); dmax.x = iftMax(dmax.x,A->dx[i]);
+    dmin.y = iftMin(dmin.y,A->dy[i]); dmax.y = iftMax(dmax.y,A->dy[i]);
+    dmin.z = iftMin(dmin.z,A->dz[i]); dmax.z = iftMax(dmax.z,A->dz[i]);
+    offset[i] = A->dx[i] + (long)A->dy[i]*xsize + (long)A->dz[i]*xsize*ysize;
+  }
+
+  #pragma omp parallel
+  {
+    int *acc = iftAllocIntArray(xsize);
+
+    #pragma omp for
+    for (int r=0; r < nrows; r++) { // for each row of the image
+      int   y = r % ysize, z = r / ysize;
+      long  p0 = (long)r*xsize;
+      float *out = &filt_img->band[bout].val[p0];
+      int   x0 = -dmin.x, x1 = xsize - dmax.x;
+
+      if ((y < -dmin.y)||(y >= ysize - dmax.y)||
+	  (z < -dmin.z)||(z >= qimg->zsize - dmax.z)||(x0 >= x1))
+	x0 = x1 = xsize; // no interior pixels in this row
+
+      if (x0 < x1) {
+	for (int x=x0; x < x1; x++)
+	  acc[x] = 0;
+	for (int i=0; i < A->n; i++) { // for each adjacent voxel
+	  for (int b=0; b < K->nbands; b++) { // for each band
+	    int w = K->weight[i*K->nbands+b];
+	    if (w == 0)
+	      continue;
+	    const uchar *src = &qimg->val[(long)b*qimg->n + p0 + offset[i]];
+	    for (int x=x0; x < x1; x++)
+	      acc[x] += w*src[x];
+	  }
+	}
+	for (int x=x0; x < x1; x++)
+	  out[x] = scale*acc[x] + K->bias;
+      }
+
+      for (int x=0; x < xsize; x++) { // border pixels
+	if ((x >= x0)&&(x < x1))
+	  continue;
+	int      sum = 0;
+	iftVoxel u   = {x,y,z};
+	for (int i=0; i < A->n; i++) {
+	  iftVoxel v = iftGetAdjacentVoxel(A,u,i);
+	  if (iftMValidVoxel(filt_img,v)){ // inside the image domain
+	    int q = iftMGetVoxelIndex(filt_img,v);
+	    for (int b=0; b < K->nbands; b++)
+	      sum += K->weight[i*K->nbands+b]*qimg->val[(long)b*qimg->n+q];
+	  }
+	}
+	out[x] = scale*sum + K->bias;
+      }
+    }
+
+    iftFree(acc);
+  }
+}
+
+iftMImage *QuantizedConvolution(QMImage *qimg, QMKernel *K)
+{
+  iftMImage *filt_img=iftCreateMImage(qimg->xsize,qimg->ysize,qimg->zsize,1); // multi-band image with one band
+
+  QuantizedConvolutionOnBand(qimg, K, filt_img, 0);
+
+  return(filt_img);
+}
+
+/* Scratch images for the single-layer NN. Each thread gets its own
+   pair of one-band images, allocated once per call and reused for
+   all kernels the thread processes. When called from a parallel
+   region (e.g., one image per thread), the kernel loop runs on a
+   single thread and a single pair is allocated. */
+
+typedef struct layer_scratch {
+  iftMImage **filt;    /* convolution and activation, one per thread */
+  iftMImage **pool;    /* max-pooling, one per thread */
+  int         nthreads;
+} LayerScratch;
+
+LayerScratch *CreateLayerScratch(int xsize, int ysize, int zsize)
+{
+  LayerScratch *scratch = (LayerScratch *)iftAlloc(1,sizeof(LayerScratch));
+
+  if (omp_get_active_level() < omp_get_max_active_levels())
+    scratch->nthreads = omp_get_max_threads();
+  else
+    scratch->nthreads = 1;
+  scratch->filt     = (iftMImage **)iftAlloc(scratch->nthreads,sizeof(iftMImage *));
+  scratch->pool     = (iftMImage **)iftAlloc(scratch->nthreads,sizeof(iftMImage *));
+  for (int t=0; t < scratch->nthreads; t++){
+    scratch->filt[t] = iftCreateMImage(xsize,ysize,zsize,1);
+    scratch->pool[t] = iftCreateMImage(xsize,ysize,zsize,1);
+  }
+
+  return(scratch);
+}
+
+void DestroyLayerScratch(LayerScratch **scratch)
+{
+  LayerScratch *aux = *scratch;
+  if (aux != NULL){
+    for (int t=0; t < aux->nthreads; t++){
+      iftDestroyMImage(&aux->filt[t]);
+      iftDestroyMImage(&aux->pool[t]);
+    }
+    iftFree(aux->filt);
+    iftFree(aux->pool);
+    iftFree(aux);
+    *scratch = NULL;
+  }
+}
+
+/* Activation and pooling of the convolution in filt_img, whose result
+   is written into band k of out. Both filt_img and pool_img are
+   overwritten. */
+
+void ActivateAndPool(iftMImage *filt_img, iftAdjRel *A[2], iftMImage *pool_img, iftMImage *out, int k)
+{
+  ReLuInPlace(filt_img); /* activation */
+  MaxPoolingOnBand(filt_img, 0, A[0], pool_img, 0);
+  MinPoolingOnBand(pool_img, 0, A[1], out, k);
+}
+
+/* Kernels are processed in parallel, each thread working on its own
+   scratch images */
+
 iftMImage *SingleLayer(iftImage *img, MKernelBank *Kbank)
 {
   iftMImage *out = iftCreateMImage(img->xsize,img->ysize,img->zsize,Kbank->nkernels);
 
-  iftAdjRel *A[2];
-  iftMImage *aux[2], *mimg;
+  iftAdjRel    *A[2];
+  iftMImage    *mimg;
+  LayerScratch *scratch;
 
   if (iftIsColorImage(img)){
     mimg   = iftImageToMImage(img,YCbCr_CSPACE);
@@ -328,30 +743,58 @@ iftMImage *SingleLayer(iftImage *img, MKernelBank *Kbank)
 
   A[0]             = iftRectangular(7,3);
   A[1]             = iftRectangular(5,5);
+  scratch          = CreateLayerScratch(img->xsize,img->ysize,img->zsize);
 
+  #pragma omp parallel for schedule(dynamic)
   for (int k=0; k < Kbank->nkernels; k++) {
+    int t = omp_get_thread_num();
+    ConvolutionOnBand(mimg, Kbank->K[k], scratch->filt[t], 0);
+    ActivateAndPool(scratch->filt[t], A, scratch->pool[t], out, k);
+  }
 
-    aux[0]        = Convolution(mimg,Kbank->K[k]);
+  for (int i = 0; i < 2; i++)
+    iftDestroyAdjRel(&A[i]);
+  DestroyLayerScratch(&scratch);
+  iftDestroyMImage(&mimg);
 
-    aux[1]        = ReLu(aux[0]); /* activation */
-    iftDestroyMImage(&aux[0]);
+  return(out);
+}
 
-    aux[0]        = MaxPooling(aux[1], A[0]);
-    iftDestroyMImage(&aux[1]);
+/* Same as SingleLayer, but with the convolutions computed on 8-bit
+   weights and activations */
 
-    aux[1]        = MinPooling(aux[0], A[1]);
-    iftDestroyMImage(&aux[0]);
+iftMImage *QuantizedSingleLayer(iftImage *img, QMKernelBank *Qbank)
+{
+  iftMImage *out = iftCreateMImage(img->xsize,img->ysize,img->zsize,Qbank->nkernels);
 
+  iftAdjRel    *A[2];
+  iftMImage    *mimg;
+  QMImage      *qimg;
+  LayerScratch *scratch;
 
-    for (int p = 0; p < out->n; p++){
-      out->band[k].val[p] = aux[1]->band[0].val[p];
-    }
+  if (iftIsColorImage(img)){
+    mimg   = iftImageToMImage(img,YCbCr_CSPACE);
+  } else {
+    mimg   = iftImageToMImage(img,GRAY_CSPACE);
+  }
+  qimg             = QuantizeMImage(mimg);
+  iftDestroyMImage(&mimg);
 
-    iftDestroyMImage(&aux[1]);
+  A[0]             = iftRectangular(7,3);
+  A[1]             = iftRectangular(5,5);
+  scratch          = CreateLayerScratch(img->xsize,img->ysize,img->zsize);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int k=0; k < Qbank->nkernels; k++) {
+    int t = omp_get_thread_num();
+    QuantizedConvolutionOnBand(qimg, Qbank->K[k], scratch->filt[t], 0);
+    ActivateAndPool(scratch->filt[t], A, scratch->pool[t], out, k);
   }
 
   for (int i = 0; i < 2; i++)
     iftDestroyAdjRel(&A[i]);
+  DestroyLayerScratch(&scratch);
+  DestroyQMImage(&qimg);
 
   return(out);
 }
@@ -400,49 +843,66 @@ void NormalizeActivationValues(iftMImage **mimg, int nimages, int maxval,
   }
 }
 
-float ComputeErrorBand(float *band, iftImage *mask, float threshold, float alpha, float beta)
-{
-  float eij = 0.0;
-  iftImage *bin = iftCreateImage(mask->xsize, mask->ysize, 1);
-  int n0, n1;
+#define NTHRESHOLDS 256 /* integer thresholds searched in training */
 
-  n0 = n1 = 0;
+/* Cumulative histograms of the activations of one image outside the
+   plate (mask == 0) and inside it (mask == 255). Position t of below0
+   and below1 is the number of activations lower than the integer
+   threshold t, and position NTHRESHOLDS+1 is the total. They provide
+   the errors of every threshold from a single pass over the image. */
 
-  for (int i=0; i < mask->n; i++) {
-    if (band[i] < threshold) {
-        bin->val[i] = 255;
-        // printf("%f\n", band[i]);
+void ThresholdHistograms(float *val, iftImage *mask, int *below0, int *below1)
+{
+  for (int k=0; k < NTHRESHOLDS+2; k++)
+    below0[k] = below1[k] = 0;
+
+  for (int p=0; p < mask->n; p++) {
+    if ((mask->val[p]==0)||(mask->val[p]==255)) {
+      int k;
+      if (val[p] < 0)                /* below any threshold */
+	k = 0;
+      else if (val[p] < NTHRESHOLDS) /* below thresholds t > val[p] */
+	k = (int)val[p] + 1;
+      else                           /* below none of them */
+	k = NTHRESHOLDS + 1;
+      if (mask->val[p]==0)
+	below0[k]++;
+      else
+	below1[k]++;
     }
   }
 
-  for (int i=0; i < mask->n; i++) {
-    if (bin->val[i] == 255 && mask->val[i]==0)
-      n0++;
-    else if (bin->val[i] == 0 && mask->val[i]==255)
-      n1++;
+  for (int k=1; k < NTHRESHOLDS+2; k++) {
+    below0[k] += below0[k-1];
+    below1[k] += below1[k-1];
   }
-
-  eij = alpha*n0 + beta*n1;
-  iftDestroyImage(&bin);
-  return eij;
 }
 
-
 void FindBestKernelWeights(iftMImage **mimg, iftImage **mask, int nimages, NetParameters *nparam)
 {
   float *w  = nparam->weight;
   float alpha = 0.1;
   float beta = 10;
   float bestTj[mimg[0]->m]; /*array for best threshold for each band */
+  int   nbins  = NTHRESHOLDS+2;
+  int  *below0 = iftAllocIntArray(nimages*nbins);
+  int  *below1 = iftAllocIntArray(nimages*nbins);
 
   for (int b=0; b< mimg[0]->m; b++) { /*For each band*/
     float ej[256]; /*Array of error for each threshold*/
-    // printf("Band %d\n", b);
+
+    #pragma omp parallel for
+    for (int i=0; i < nimages; i++)
+      ThresholdHistograms(mimg[i]->band[b].val, mask[i], &below0[i*nbins], &below1[i*nbins]);
+
     for (int tj=0; tj <= 255; tj++)  { /*linear search of band threshold*/
-      // printf("Threshold %d\n", tj);
       float eij = 0.0;
-      for (int i=0; i < nimages; i++) { /*For each image */
-        eij += ComputeErrorBand(mimg[i]->band[b].val, mask[i], (float) tj, alpha, beta);
+      for (int i=0; i < nimages; i++) { /*For each image, activations
+					    below tj are plate pixels */
+	int   n0 = below0[i*nbins+tj];
+	int   n1 = below1[i*nbins+nbins-1] - below1[i*nbins+tj];
+	float ei = alpha*n0 + beta*n1;
+        eij += ei;
       }
       ej[tj] = eij / (float) nimages;
     }
@@ -467,6 +927,8 @@ void FindBestKernelWeights(iftMImage **mimg, iftImage **mask, int nimages, NetPa
   for (int j=0; j < mimg[0]->m; j++)
     w[j] = 1 - (bestTj[j] / sumOfBands);
 
+  iftFree(below0);
+  iftFree(below1);
 }
 
 void RegionOfPlates(iftImage **mask, int nimages, NetParameters *nparam)
@@ -511,27 +973,46 @@ void RemoveActivationsOutOfRegionOfPlates(iftMImage **mimg, int nimages, NetPara
   }
 }
 
+/* The weighted sum and its max-pooling are computed in two scratch
+   images, which are reused while consecutive images have the same
+   size. */
+
 iftMImage **CombineBands(iftMImage **mimg, int nimages, float *weight)
 {
   iftMImage **cbands = (iftMImage **) calloc(nimages,sizeof(iftMImage *));
-  iftAdjRel *A[2];
+  iftMImage  *aux[2] = {NULL, NULL};
+  iftAdjRel  *A[2];
 
   A[0] = iftRectangular(7,3);
   A[1] = iftRectangular(9,9);
 
   for (int i=0; i < nimages; i++) {
-    cbands[i] = iftCreateMImage(mimg[i]->xsize,mimg[i]->ysize,mimg[i]->zsize,1);
-    for (int p = 0; p < cbands[i]->n; p++) {
+    if ((aux[0] == NULL)||(aux[0]->xsize != mimg[i]->xsize)||
+	(aux[0]->ysize != mimg[i]->ysize)||(aux[0]->zsize != mimg[i]->zsize)){
+      if (aux[0] != NULL){
+	iftDestroyMImage(&aux[0]);
+	iftDestroyMImage(&aux[1]);
+      }
+      aux[0] = iftCreateMImage(mimg[i]->xsize,mimg[i]->ysize,mimg[i]->zsize,1);
+      aux[1] = iftCreateMImage(mimg[i]->xsize,mimg[i]->ysize,mimg[i]->zsize,1);
+    }
+    #pragma omp parallel for
+    for (int p = 0; p < aux[0]->n; p++) {
+      float sum = 0;
       for (int b=0; b < mimg[0]->m; b++) {
-	cbands[i]->band[0].val[p] += weight[b]*mimg[i]->band[b].val[p];
+	sum += weight[b]*mimg[i]->band[b].val[p];
       }
+      aux[0]->band[0].val[p] = sum;
     }
-    iftMImage *aux = MaxPooling(cbands[i], A[0]);
-    iftDestroyMImage(&cbands[i]);
-    cbands[i] = MinPooling(aux,A[1]);
-    iftDestroyMImage(&aux);
+    MaxPoolingOnBand(aux[0], 0, A[0], aux[1], 0);
+    cbands[i] = iftCreateMImage(mimg[i]->xsize,mimg[i]->ysize,mimg[i]->zsize,1);
+    MinPoolingOnBand(aux[1], 0, A[1], cbands[i], 0);
   }
 
+  if (aux[0] != NULL){
+    iftDestroyMImage(&aux[0]);
+    iftDestroyMImage(&aux[1]);
+  }
   iftDestroyAdjRel(&A[0]);
   iftDestroyAdjRel(&A[1]);
 
@@ -555,29 +1036,36 @@ iftImage **ApplyThreshold(iftMImage **cbands, int nimages, NetParameters *nparam
   return(bin);
 }
 
+/* Error of thresholding a combined band, as done by ApplyThreshold,
+   counted without creating the binary image */
+
+float ComputeErrorThreshold(float *val, iftImage *mask, float threshold, float alpha, float beta)
+{
+  int n0 = 0;
+  int n1 = 0;
+
+  for (int p=0; p < mask->n; p++) {
+    if (val[p] >= threshold) {
+      if (mask->val[p]==0)
+	n0++;
+    } else if (mask->val[p]==255)
+      n1++;
+  }
+
+  return(alpha*n0 + beta*n1);
+}
+
 float AverageErrorThreshold(iftMImage **cbands, iftImage **mask, int nimages, NetParameters *nparam)
 {
-  iftImage **bin;
   float avgError;
   float ei = 0.0;
   float alpha = 1;
   float beta = 10;
 
-  bin = ApplyThreshold(cbands, nimages, nparam);
   for (int i=0; i < nimages; i++){
-    int n0 = 0;
-    int n1 = 0;
-    for (int p=0; p < bin[i]->n; p++) {
-      if (bin[i]->val[p]==255 && mask[i]->val[p]==0)
-        n0++;
-      if (bin[i]->val[p]==0 && mask[i]->val[p]==255)
-        n1++;
-    }
-    // printf("%d %d\n", n0, n1);
-    ei += alpha*n0 + beta*n1;
+    ei += ComputeErrorThreshold(cbands[i]->band[0].val, mask[i], nparam->threshold, alpha, beta);
   }
 
-  iftFree(bin);
   avgError = ei / nimages;
   // printf("%f\n",avgError);
   return avgError;
@@ -589,28 +1077,22 @@ void FindBestThreshold(iftMImage **cbands, iftImage **mask, int nimages, NetPara
   float alpha = 1;
   float beta = 10;
   float e[256];
-  iftImage **bin;
+  int   nbins  = NTHRESHOLDS+2;
+  int  *below0 = iftAllocIntArray(nimages*nbins);
+  int  *below1 = iftAllocIntArray(nimages*nbins);
 
+  #pragma omp parallel for
+  for (int i=0; i < nimages; i++)
+    ThresholdHistograms(cbands[i]->band[0].val, mask[i], &below0[i*nbins], &below1[i*nbins]);
 
   for (int t=0; t <=255; t++) {
-    nparam->threshold = (float) t;
-    /*Applying threshold on images*/
-    bin = ApplyThreshold(cbands, nimages, nparam);
-
-    /*Computing error array*/
-    // printf("Threshold %d\n", t);
+    /*Computing error array, activations from t on are plate pixels*/
     float ei = 0.0;
     for (int i=0; i < nimages; i++){
-      int n0 = 0;
-      int n1 = 0;
-      for (int p=0; p < bin[i]->n; p++) {
-        if (bin[i]->val[p]==255 && mask[i]->val[p]==0)
-          n0++;
-        if (bin[i]->val[p]==0 && mask[i]->val[p]==255)
-          n1++;
-      }
-    //   // printf("%d %d\n", n0, n1);
-      ei += alpha*n0 + beta*n1;
+      int   n0 = below0[i*nbins+nbins-1] - below0[i*nbins+t];
+      int   n1 = below1[i*nbins+t];
+      float eit = alpha*n0 + beta*n1;
+      ei += eit;
     }
     // printf("------------------\n");
     e[t] = ei / nimages;
@@ -630,7 +1112,8 @@ void FindBestThreshold(iftMImage **cbands, iftImage **mask, int nimages, NetPara
   }
   nparam->threshold = bestT;
 
-  iftFree(bin);
+  iftFree(below0);
+  iftFree(below1);
 }
 
 void SelectCompClosestTotheMeanWidthAndHeight(iftImage *label, float mean_width, float mean_height)
@@ -706,7 +1189,11 @@ void PostProcess(iftImage **bin, int nimages, NetParameters *nparam)
   iftDestroyAdjRel(&A);
 }
 
-void WriteResults(iftFileSet *fileSet, iftImage **bin)
+/* Draw the borders of the detected plates on the input images, which
+   are modified, and write them. The images are those already decoded
+   for processing, so they are not read again. */
+
+void WriteResults(iftFileSet *fileSet, iftImage **img, iftImage **bin)
 {
   iftColor RGB, YCbCr;
   iftAdjRel *A = iftCircular(1.0), *B = iftCircular(sqrtf(2.0));
@@ -717,15 +1204,14 @@ void WriteResults(iftFileSet *fileSet, iftImage **bin)
 
   YCbCr      = iftRGBtoYCbCr(RGB, 255);
 
+  #pragma omp parallel for schedule(dynamic)
   for (int i=0; i < fileSet->n; i++) {
-    iftImage  *img   = iftReadImageByExt(fileSet->files[i]->path);
     char filename[200];
     iftSList *list = iftSplitString(fileSet->files[i]->path,"_");
     iftSNode *L    = list->tail;
     sprintf(filename,"result_%s",L->elem);
-    iftDrawBorders(img,bin[i],A,YCbCr,B);
-    iftWriteImageByExt(img,filename);
-    iftDestroyImage(&img);
+    iftDrawBorders(img[i],bin[i],A,YCbCr,B);
+    iftWriteImageByExt(img[i],filename);
     iftDestroySList(&list);
   }
 
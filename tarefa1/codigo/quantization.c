@@ -0,0 +1,126 @@
+#include "include/ift.h"
+#include "neural_net.c"
+
+/* This program compares the float and the 8-bit (quantized) versions
+   of the single-layer NN on a set of images. It reports the drift of
+   the kernel activations, the average error of the final threshold
+   for both versions, and the fraction of pixels in which their
+   post-processed binary images disagree. */
+
+iftImage *ReadMaskImage(char *pathname)
+{
+  iftImage *mask = NULL;
+  iftSList *list = iftSplitString(pathname,"_");
+  iftSNode *L    = list->tail;
+  char      filename[200];
+  sprintf(filename,"./imagens/placas/mask_%s",L->elem);
+  mask = iftReadImageByExt(filename);
+  iftDestroySList(&list);
+  return(mask);
+}
+
+int main(int argc, char *argv[])
+{
+  iftImage      **mask, **bin[2];
+  iftMImage     **mimg[2], **cbands[2];
+  NetParameters  *nparam[2];
+  float           time[2] = {0.0, 0.0}, avgError[2];
+
+  if (argc!=4)
+    iftError("quantization <testX.txt (X=1,2,3,4,5)> <kernel-bank.txt> <input-parameters.txt>","main");
+
+  /* Read input images, kernel bank, and parameters (one copy for
+     each version, since the normalization may update them) */
+
+  iftFileSet   *testSet = iftLoadFileSetFromCSV(argv[1], false);
+  MKernelBank  *Kbank   = ReadMKernelBank(argv[2]);
+  QMKernelBank *Qbank   = QuantizeMKernelBank(Kbank);
+  nparam[0]             = ReadNetParameters(argv[3]);
+  nparam[1]             = ReadNetParameters(argv[3]);
+  mask    = (iftImage **)  calloc(testSet->n,sizeof(iftImage *));
+  mimg[0] = (iftMImage **) calloc(testSet->n,sizeof(iftMImage *));
+  mimg[1] = (iftMImage **) calloc(testSet->n,sizeof(iftMImage *));
+
+  for (int k=0; k < Qbank->nkernels; k++)
+    printf("Kernel %d: weight scale %f\n",k,Qbank->K[k]->scale);
+
+  /* Apply both versions of the NN in all images */
+
+  float  maxdiff[Kbank->nkernels], meandiff[Kbank->nkernels];
+  long   nvoxels = 0;
+
+  for (int k=0; k < Kbank->nkernels; k++)
+    maxdiff[k] = meandiff[k] = 0.0;
+
+  for (int i=0; i < testSet->n; i++) {
+    printf("Processing file %s\n",testSet->files[i]->path);
+    iftImage *img = iftReadImageByExt(testSet->files[i]->path);
+    mask[i]       = ReadMaskImage(testSet->files[i]->path);
+
+    timer *tstart = iftTic();
+    mimg[0][i]    = SingleLayer(img,Kbank);
+    time[0]      += iftCompTime(tstart, iftToc());
+    tstart        = iftTic();
+    mimg[1][i]    = QuantizedSingleLayer(img,Qbank);
+    time[1]      += iftCompTime(tstart, iftToc());
+
+    for (int k=0; k < Kbank->nkernels; k++) {
+      for (int p=0; p < mimg[0][i]->n; p++) {
+	float diff = fabs(mimg[0][i]->band[k].val[p]-mimg[1][i]->band[k].val[p]);
+	meandiff[k] += diff;
+	if (diff > maxdiff[k])
+	  maxdiff[k] = diff;
+      }
+    }
+    nvoxels += img->n;
+    iftDestroyImage(&img);
+  }
+
+  puts("\nActivation drift per kernel (before normalization):");
+  for (int k=0; k < Kbank->nkernels; k++)
+    printf("Kernel %d: mean %f max %f\n",k,meandiff[k]/nvoxels,maxdiff[k]);
+
+  /* Complete the pipeline for both versions */
+
+  for (int v=0; v < 2; v++) {
+    NormalizeActivationValues(mimg[v],testSet->n,255,nparam[v]);
+    cbands[v] = CombineBands(mimg[v], testSet->n, nparam[v]->weight);
+    RemoveActivationsOutOfRegionOfPlates(cbands[v], testSet->n, nparam[v]);
+    bin[v]    = ApplyThreshold(cbands[v], testSet->n, nparam[v]);
+    PostProcess(bin[v],testSet->n, nparam[v]);
+    avgError[v] = AverageErrorThreshold(cbands[v], mask, testSet->n, nparam[v]);
+  }
+
+  long ndisagree = 0;
+  for (int i=0; i < testSet->n; i++)
+    for (int p=0; p < bin[0][i]->n; p++)
+      if (bin[0][i]->val[p] != bin[1][i]->val[p])
+	ndisagree++;
+
+  printf("\nAverage error for test threshold: float %.2f int8 %.2f\n", avgError[0], avgError[1]);
+  printf("Disagreeing pixels after post-processing: %.4f%%\n", 100.0*ndisagree/nvoxels);
+  printf("Single layer time: float %s, int8 %s\n",iftFormattedTime(time[0]),iftFormattedTime(time[1]));
+
+  /* Free memory */
+
+  for (int i=0; i < testSet->n; i++) {
+    iftDestroyImage(&mask[i]);
+    for (int v=0; v < 2; v++) {
+      iftDestroyImage(&bin[v][i]);
+      iftDestroyMImage(&cbands[v][i]);
+      iftDestroyMImage(&mimg[v][i]);
+    }
+  }
+  iftFree(mask);
+  for (int v=0; v < 2; v++) {
+    iftFree(mimg[v]);
+    iftFree(bin[v]);
+    iftFree(cbands[v]);
+    DestroyNetParameters(&nparam[v]);
+  }
+  iftDestroyFileSet(&testSet);
+  DestroyMKernelBank(&Kbank);
+  DestroyQMKernelBank(&Qbank);
+
+  return(0);
+}
@@ -16,29 +16,39 @@ iftImage *ReadMaskImage(char *pathname)
 
 int main(int argc, char *argv[])
 {
-  iftImage  **mask;
+  iftImage  **mask, **img;
   iftMImage **mimg, **cbands;
   NetParameters *nparam;
 
-  if (argc!=4)
-    iftError("testing <testX.txt (X=1,2,3,4,5)> <kernel-bank.txt> <input-parameters.txt>","main");
+  if ((argc!=4)&&(argc!=5))
+    iftError("testing <testX.txt (X=1,2,3,4,5)> <kernel-bank.txt> <input-parameters.txt> [<int8 kernels: 0/1>]","main");
+  if ((argc==5)&&(strcmp(argv[4],"0")!=0)&&(strcmp(argv[4],"1")!=0))
+    iftError("Invalid int8 option %s: use 0 (float kernels) or 1 (int8 kernels)","main",argv[4]);
 
   /* Read input images and kernel bank */
 
   iftFileSet  *testSet = iftLoadFileSetFromCSV(argv[1], false);
+  img  = (iftImage **)  calloc(testSet->n,sizeof(iftImage *));
   mask = (iftImage **)  calloc(testSet->n,sizeof(iftImage *));
   mimg = (iftMImage **) calloc(testSet->n,sizeof(iftMImage *));
   MKernelBank *Kbank    = ReadMKernelBank(argv[2]);
   nparam                = ReadNetParameters(argv[3]);
+  QMKernelBank *Qbank   = NULL;
+  if ((argc==5)&&(strcmp(argv[4],"1")==0))
+    Qbank               = QuantizeMKernelBank(Kbank);
 
-  /* Apply NN in all test images */
+  /* Apply NN in all test images. Images are read and processed in
+     parallel, one image per thread. */
 
+  #pragma omp parallel for schedule(dynamic)
   for (int i=0; i < testSet->n; i++) {
     printf("Processing file %s\n",testSet->files[i]->path);
-    iftImage  *img   = iftReadImageByExt(testSet->files[i]->path);
+    img[i]           = iftReadImageByExt(testSet->files[i]->path);
     mask[i]          = ReadMaskImage(testSet->files[i]->path);
-    mimg[i]          = SingleLayer(img,Kbank);
-    iftDestroyImage(&img);
+    if (Qbank != NULL)
+      mimg[i]        = QuantizedSingleLayer(img[i],Qbank);
+    else
+      mimg[i]        = SingleLayer(img[i],Kbank);
   }
 
   /* Normalize activation values within [0,255] */
@@ -57,23 +67,27 @@ int main(int argc, char *argv[])
 
   PostProcess(bin,testSet->n, nparam);
   float avgError = AverageErrorThreshold(cbands, mask, testSet->n, nparam);
-  WriteResults(testSet,bin);
+  WriteResults(testSet,img,bin);
   printf("Average error for test threshold: %.2f\n", avgError);
 
   /* Free memory */
 
   for (int i=0; i < testSet->n; i++) {
+    iftDestroyImage(&img[i]);
     iftDestroyImage(&mask[i]);
     iftDestroyImage(&bin[i]);
     iftDestroyMImage(&cbands[i]);
     iftDestroyMImage(&mimg[i]);
   }
+  iftFree(img);
   iftFree(mask);
   iftFree(mimg);
   iftFree(bin);
   iftFree(cbands);
   iftDestroyFileSet(&testSet);
   DestroyMKernelBank(&Kbank);
+  if (Qbank != NULL)
+    DestroyQMKernelBank(&Qbank);
   DestroyNetParameters(&nparam);
 
 
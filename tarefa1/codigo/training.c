@@ -15,7 +15,7 @@ iftImage *ReadMaskImage(char *pathname)
 
 int main(int argc, char *argv[])
 {
-  iftImage  **mask;
+  iftImage  **mask, **img;
   iftMImage **mimg, **cbands;
 
   if (argc!=4)
@@ -24,23 +24,25 @@ int main(int argc, char *argv[])
   /* Read input images and kernel bank */
 
   iftFileSet  *trainSet = iftLoadFileSetFromCSV(argv[1], false);
+  img  = (iftImage **)  calloc(trainSet->n,sizeof(iftImage *));
   mask = (iftImage **)  calloc(trainSet->n,sizeof(iftImage *));
   mimg = (iftMImage **) calloc(trainSet->n,sizeof(iftMImage *));
   MKernelBank *Kbank    = ReadMKernelBank(argv[2]);
 
-  /* Apply the single-layer NN in all training images */
+  /* Apply the single-layer NN in all training images. Images are
+     read and processed in parallel, one image per thread. */
 
+  #pragma omp parallel for schedule(dynamic)
   for (int i=0; i < trainSet->n; i++) {
     printf("Processing file %s\n",trainSet->files[i]->path);
-    iftImage  *img   = iftReadImageByExt(trainSet->files[i]->path);
+    img[i]           = iftReadImageByExt(trainSet->files[i]->path);
     mask[i]          = ReadMaskImage(trainSet->files[i]->path);
     if (mask[i] == NULL)
       printf("Mask NULL");
-    if ((img->xsize != 352) || (img->ysize != 240))
+    if ((img[i]->xsize != 352) || (img[i]->ysize != 240))
       printf("imagem %s ",trainSet->files[i]->path);
 
-    mimg[i]          = SingleLayer(img,Kbank);
-    iftDestroyImage(&img);
+    mimg[i]          = SingleLayer(img[i],Kbank);
   }
 
   /* Compute plate parameters and normalize activation values within
@@ -67,16 +69,18 @@ int main(int argc, char *argv[])
   /* Post-process binary images and write results on training set */
 
   PostProcess(bin,trainSet->n, nparam);
-  WriteResults(trainSet,bin);
+  WriteResults(trainSet,img,bin);
 
   /* Free memory */
 
   for (int i=0; i < trainSet->n; i++) {
+    iftDestroyImage(&img[i]);
     iftDestroyImage(&mask[i]);
     iftDestroyImage(&bin[i]);
     iftDestroyMImage(&cbands[i]);
     iftDestroyMImage(&mimg[i]);
   }
+  iftFree(img);
   iftFree(mask);
   iftFree(mimg);
   iftFree(bin);
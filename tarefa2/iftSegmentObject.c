@@ -24,24 +24,38 @@ void iftMyDrawBinaryLabeledSeeds(iftImage *img,iftLabeledSet *seeds,iftColor YCb
   }
 }
 
+/* Compute the Euclidean distance between the features of voxels p
+   and q directly from the bands of mimg. It accumulates in the same
+   order as iftFeatDistance, so the result is the same, but it does not
+   need per-arc copies of the feature vectors and it can be called from
+   parallel loops. */
+
+static inline float iftMVoxelFeatDistance(iftMImage *mimg, int p, int q)
+{
+  float dist = 0.0;
+
+  for (int f=0; f < mimg->m; f++) {
+    float diff = mimg->band[f].val[p] - mimg->band[f].val[q];
+    dist += diff*diff;
+  }
+
+  return(sqrtf(dist));
+}
+
 /* Compute the maximum arc weight of the image graph */
 
 float iftMaxArcWeight(iftMImage *mimg, iftAdjRel *A)
 {
-  float      Featp[mimg->m], Featq[mimg->m], maxarcw=IFT_INFINITY_FLT_NEG;
-
+  float maxarcw=IFT_INFINITY_FLT_NEG;
 
+#pragma omp parallel for reduction(max:maxarcw)
   for (int p=0; p < mimg->n; p++){
     iftVoxel u = iftMGetVoxelCoord(mimg,p);
     for (int i=1; i < A->n; i++){
       iftVoxel v = iftGetAdjacentVoxel(A,u,i);
       if (iftMValidVoxel(mimg,v)){
         int q = iftMGetVoxelIndex(mimg,v);
-        for (int f=0; f < mimg->m; f++) {
-          Featp[f] = mimg->band[f].val[p];
-          Featq[f] = mimg->band[f].val[q];
-        }
-        float fdist = iftFeatDistance(Featp,Featq,mimg->m);
+        float fdist = iftMVoxelFeatDistance(mimg,p,q);
         if (fdist > maxarcw)
         maxarcw = fdist;
       }
@@ -55,24 +69,23 @@ float iftMaxArcWeight(iftMImage *mimg, iftAdjRel *A)
 
 iftFImage *iftArcWeightImage(iftMImage *mimg, iftImage *objmap, float alpha, iftAdjRel *A)
 {
-  float Featp[mimg->m], Featq[mimg->m], fmax=0.0, fdist;
   iftFImage *weight = iftCreateFImage(mimg->xsize,mimg->ysize,mimg->zsize);
 
   if ((objmap == NULL)&&(alpha != 0.0))
   iftError("It requires an object map for alpha=%f","iftArcWeightImage",alpha);
 
+  /* Each voxel only writes its own weight, so the voxels are split
+     among threads */
+
+#pragma omp parallel for
   for (int p=0; p < mimg->n; p++){
     iftVoxel u = iftMGetVoxelCoord(mimg,p);
-    fmax = 0.0;
+    float fmax = 0.0;
     for (int i=1; i < A->n; i++){
       iftVoxel v = iftGetAdjacentVoxel(A,u,i);
       if (iftMValidVoxel(mimg,v)){
         int q = iftMGetVoxelIndex(mimg,v);
-        for (int f=0; f < mimg->m; f++) {
-          Featp[f] = mimg->band[f].val[p];
-          Featq[f] = mimg->band[f].val[q];
-        }
-        fdist = iftFeatDistance(Featp,Featq,mimg->m);
+        float fdist = iftMVoxelFeatDistance(mimg,p,q);
         if (fdist > fmax)
         fmax = fdist;
       }
@@ -85,14 +98,15 @@ iftFImage *iftArcWeightImage(iftMImage *mimg, iftImage *objmap, float alpha, ift
     float Wmax = iftFMaximumValue(weight);
     float Omax = iftMaximumValue(objmap);
 
+#pragma omp parallel for
     for (int p=0; p < mimg->n; p++){
       iftVoxel u = iftMGetVoxelCoord(mimg,p);
-      fmax = 0.0;
+      float fmax = 0.0;
       for (int i=1; i < A->n; i++){
         iftVoxel v = iftGetAdjacentVoxel(A,u,i);
         if (iftMValidVoxel(mimg,v)){
           int q = iftMGetVoxelIndex(mimg,v);
-          fdist = fabs(objmap->val[q]-objmap->val[p]);
+          float fdist = fabs(objmap->val[q]-objmap->val[p]);
           if (fdist > fmax)
           fmax = fdist;
         }
@@ -105,6 +119,205 @@ iftFImage *iftArcWeightImage(iftMImage *mimg, iftImage *objmap, float alpha, ift
   return(weight);
 }
 
+/* Pivot-based index over the nodes of a trained complete graph. For
+   a test sample t, a node s and a pivot sample pj, the triangle
+   inequality gives |d(t,pj)-d(s,pj)| <= d(t,s). A node whose lower
+   bound is already above the current minimum cost cannot change the
+   classification, so its distance to t is not computed. */
+
+#define NPIVOTS     4
+#define PIVOT_SLACK 1e-4  /* relative tolerance for rounding errors in the bound */
+
+typedef struct ift_cplgraph_index {
+  int    npivots;
+  int   *pivot;     /* training samples used as pivots */
+  float *dist;      /* dist[i*npivots+j]: distance from the i-th node in
+		       graph->ordered_nodes to the j-th pivot */
+  float  maxdist;   /* maximum value in dist */
+} iftCplGraphIndex;
+
+/* Selects the pivots by farthest-first traversal of the training
+   samples, starting from the first node in the ordered list */
+
+iftCplGraphIndex *iftCreateCplGraphIndex(const iftCplGraph *graph)
+{
+  iftDataSet       *Z     = graph->Z;
+  iftCplGraphIndex *index = (iftCplGraphIndex *)iftAlloc(1,sizeof(iftCplGraphIndex));
+  float            *mindist = iftAllocFloatArray(graph->nnodes);
+
+  index->npivots = iftMin(NPIVOTS, graph->nnodes);
+  index->pivot   = iftAllocIntArray(index->npivots);
+  index->dist    = iftAllocFloatArray(graph->nnodes*index->npivots);
+  index->maxdist = 0.0;
+
+  for (int i=0; i < graph->nnodes; i++)
+    mindist[i] = IFT_INFINITY_FLT;
+
+  int next = 0;
+  for (int j=0; j < index->npivots; j++) {
+    int pj = graph->node[graph->ordered_nodes[next]].sample;
+    index->pivot[j] = pj;
+    next = 0;
+    for (int i=0; i < graph->nnodes; i++) {
+      int s = graph->node[graph->ordered_nodes[i]].sample;
+      float d = Z->iftArcWeight(Z->sample[s].feat,Z->sample[pj].feat,Z->alpha,Z->nfeats);
+      index->dist[i*index->npivots+j] = d;
+      if (d > index->maxdist)
+	index->maxdist = d;
+      if (d < mindist[i])
+	mindist[i] = d;
+      if (mindist[i] > mindist[next])
+	next = i;
+    }
+  }
+
+  iftFree(mindist);
+
+  return(index);
+}
+
+void iftDestroyCplGraphIndex(iftCplGraphIndex **index)
+{
+  if (*index != NULL) {
+    iftFree((*index)->pivot);
+    iftFree((*index)->dist);
+    iftFree(*index);
+    *index = NULL;
+  }
+}
+
+/* Returns true when the i-th node in the ordered list is certainly not
+   closer than mincost to the test sample, whose distances to the
+   pivots are in dt */
+
+static inline bool iftPrunedNode(const iftCplGraphIndex *index, int i, const float *dt, float mincost, float slack)
+{
+  const float *ds = &index->dist[i*index->npivots];
+
+  for (int j=0; j < index->npivots; j++)
+    if (fabsf(dt[j]-ds[j]) > mincost + slack)
+      return(true);
+
+  return(false);
+}
+
+/* Same result as iftClassifyWithCertaintyValues, including the order
+   in which the nodes are visited, but nodes that cannot change the
+   minimum costs are pruned by the index. The test samples are split
+   among threads. */
+
+int iftIndexedClassifyWithCertaintyValues(const iftCplGraph *graph, const iftCplGraphIndex *index, iftDataSet *Ztest)
+{
+  iftDataSet *Z = graph->Z;
+  int nerrors = 0;
+
+  if (Z->nfeats != Ztest->nfeats)
+    iftError("Train and test sets with different numbers of features","iftIndexedClassifyWithCertaintyValues");
+
+  /* The pruning relies on the triangle inequality, so the index only
+     applies when the distance function of the dataset is the
+     (weighted) Euclidean distance iftDistance1, the default one. A
+     precomputed distance table or any other distance function, which
+     need not be a metric (e.g., iftDistance2 is the log of the
+     Euclidean distance), falls back to the library. */
+
+  if ((iftDist != NULL)||(Z->iftArcWeight != iftDistance1))
+    return(iftClassifyWithCertaintyValues(graph,Ztest));
+
+#pragma omp parallel
+  {
+  int last = IFT_NIL; /* last sample classified by this thread */
+
+#pragma omp for
+  for (int t=0; t < Ztest->nsamples; t++) {
+    Ztest->sample[t].weight = 1.0;
+    if (!(Ztest->sample[t].status & IFT_TEST))
+      continue;
+
+    float *feat = Ztest->sample[t].feat, dt[index->npivots];
+
+    /* Neighboring pixels often have the same features, and then the
+       same label and certainty */
+
+    if ((last != IFT_NIL)&&
+	(memcmp(feat,Ztest->sample[last].feat,Z->nfeats*sizeof(float))==0)) {
+      Ztest->sample[t].label  = Ztest->sample[last].label;
+      Ztest->sample[t].weight = Ztest->sample[last].weight;
+      continue;
+    }
+    last = t;
+
+    float  dtmax = 0.0;
+    for (int j=0; j < index->npivots; j++) {
+      dt[j] = Z->iftArcWeight(Z->sample[index->pivot[j]].feat,feat,Z->alpha,Z->nfeats);
+      if (dt[j] > dtmax)
+	dtmax = dt[j];
+    }
+    float slack = PIVOT_SLACK*(dtmax + index->maxdist);
+
+    /* Minimum cost among all nodes, which assigns the label */
+
+    int   u = graph->ordered_nodes[0], s = graph->node[u].sample;
+    float cost1 = iftMax(graph->pathval[u],Z->iftArcWeight(Z->sample[s].feat,feat,Z->alpha,Z->nfeats));
+    int   label = Z->sample[s].label;
+
+    for (int i=1; (i < graph->nnodes)&&(cost1 > graph->pathval[graph->ordered_nodes[i]]); i++) {
+      if (iftPrunedNode(index,i,dt,cost1,slack))
+	continue;
+      u = graph->ordered_nodes[i];
+      s = graph->node[u].sample;
+      float tmp = iftMax(graph->pathval[u],Z->iftArcWeight(Z->sample[s].feat,feat,Z->alpha,Z->nfeats));
+      if (cost1 > tmp) {
+	cost1 = tmp;
+	label = Z->sample[s].label;
+      }
+    }
+    Ztest->sample[t].label = label;
+
+    /* Minimum cost among the nodes of the other classes. The start
+       node and the first visited position follow the library. */
+
+    int i = 0;
+    u = graph->ordered_nodes[0];
+    s = graph->node[u].sample;
+    while ((i < graph->nnodes)&&(Z->sample[s].label == label)) {
+      u = graph->ordered_nodes[i];
+      s = graph->node[u].sample;
+      i++;
+    }
+    float cost2 = iftMax(graph->pathval[u],Z->iftArcWeight(Z->sample[s].feat,feat,Z->alpha,Z->nfeats));
+
+    for (; i < graph->nnodes-1; i++) {
+      u = graph->ordered_nodes[i+1];
+      s = graph->node[u].sample;
+      if (Z->sample[s].label != label) {
+	if (graph->pathval[u] >= cost2)
+	  break;
+	if (iftPrunedNode(index,i+1,dt,cost2,slack))
+	  continue;
+	float tmp = iftMax(graph->pathval[u],Z->iftArcWeight(Z->sample[s].feat,feat,Z->alpha,Z->nfeats));
+	cost2 = iftMin(tmp,cost2);
+      }
+    }
+
+    float sum = cost1 + cost2;
+    if (iftAlmostZero(sum))
+      Ztest->sample[t].weight = 0.5;
+    else
+      Ztest->sample[t].weight = cost2/sum;
+  }
+  }
+
+  for (int t=0; t < Ztest->nsamples; t++)
+    if (Ztest->sample[t].truelabel != Ztest->sample[t].label) {
+      Ztest->sample[t].status |= IFT_ERROR;
+      nerrors++;
+    }
+  Ztest->ngroups = Z->nclasses;
+
+  return(nerrors);
+}
+
 /* Computes the object map */
 
 iftImage *iftObjectMap(iftMImage *mimg, iftLabeledSet *training_set, int Imax)
@@ -122,12 +335,14 @@ iftImage *iftObjectMap(iftMImage *mimg, iftLabeledSet *training_set, int Imax)
 
   iftDataSet *Z   = iftMImageToDataSet(mimg, NULL);
   iftSetStatus(Z,IFT_TEST);
-  iftClassifyWithCertaintyValues(graph, Z);
+  iftCplGraphIndex *index = iftCreateCplGraphIndex(graph);
+  iftIndexedClassifyWithCertaintyValues(graph, index, Z);
   iftImage  *aux  = iftDataSetObjectMap(Z, NULL, Imax, 2);
 
   iftDestroyDataSet(&Z1);
   iftDestroyDataSet(&Z);
   iftDestroyCplGraph(&graph);
+  iftDestroyCplGraphIndex(&index);
 
   /* post-processing */
 